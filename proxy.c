@@ -8,16 +8,201 @@
  *
  */
 
+#define _GNU_SOURCE	/* For sched_getcpu() */
+
 #include "csapp.h"
 #include <assert.h>
+#include <limits.h>
 #include <malloc.h>
+#include <poll.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_RDTSC	1	/* Timestamp with the cycle counter. */
+#endif
 
 #define BUF_SIZE 128	/* Per-connection internal buffer size. */
 
+/* Admission control table geometry */
+#define ADMIT_SHARDS		64	/* Client table shards (power of 2). */
+#define ADMIT_BUCKETS		256	/* Hash buckets per shard (power of 2). */
+
+/*
+ * Client table hashing.  The top bits of a multiplicative hash of the
+ * address pick the shard and the bits below them pick the bucket, so
+ * neither depends on the address's byte order.
+ */
+#define CLIENT_HASH(addr)	((uint32_t)(addr) * 2654435761u)
+#define CLIENT_SHARD(addr)	(CLIENT_HASH(addr) >> 26 & (ADMIT_SHARDS - 1))
+#define CLIENT_BUCKET(addr)	(CLIENT_HASH(addr) >> 18 & (ADMIT_BUCKETS - 1))
+
+/* Admission control defaults, overridden by the configuration file */
+#define ADMIT_MAX_INFLIGHT	1024	/* Connections in flight overall. */
+#define ADMIT_MAX_CONNS		32	/* Concurrent connections per client. */
+#define ADMIT_REQ_RATE		50	/* Requests per second per client. */
+#define ADMIT_REQ_BURST		100
+#define ADMIT_BYTE_RATE		(8 << 20)	/* Bytes per second per client. */
+#define ADMIT_BYTE_BURST	(16 << 20)
+#define ADMIT_EXPIRY		60	/* Idle seconds before a client expires. */
+
+/* Admission results */
+#define ADMIT_OK	0
+#define ADMIT_BUSY	503	/* Global in-flight or memory limit reached. */
+#define ADMIT_LIMITED	429	/* Per-client limit reached. */
+
+/* Other configuration defaults */
+#define CONFIG_LOG_PATH		"proxy.log"
+#define CONFIG_IO_TIMEOUT	0	/* Socket timeout in seconds, 0 = none. */
+#define CONFIG_DRAIN_TIMEOUT	30	/* Seconds to finish transfers on exit. */
+#define UPGRADE_TIMEOUT		5	/* Seconds to wait on a handoff peer. */
+#define CONFIG_TRACE_PATH	"proxy.trace"
+#define CONFIG_NAMELEN		256
+#define CONFIG_RELAY_MIN	256	/* Smallest relay buffer; lines need room. */
+
+/*
+ * Runtime configuration.  The current configuration is published through
+ * "config" and replaced wholesale on SIGHUP; transactions keep using the
+ * copy they acquired until they release it.
+ */
+struct config {
+	char listen[CONFIG_NAMELEN];	/* [host:]port, read at startup only */
+	int max_inflight;
+	int max_client_conns;
+	int req_rate;
+	int req_burst;
+	int byte_rate;
+	int byte_burst;
+	int client_expiry;
+	int relay_buf_size;	/* At most MAXBUF */
+	int io_timeout;
+	int log_enabled;
+	char log_path[CONFIG_NAMELEN];
+	char upgrade_socket[CONFIG_NAMELEN];	/* Read at startup only */
+	int drain_timeout;
+	int trace_sample;	/* Trace 1 in this many requests, 0 = none */
+	int trace_log_fields;	/* Append spans to access log entries */
+	int trace_binary;	/* Dump format: 0 = Chrome JSON, 1 = binary */
+	char trace_path[CONFIG_NAMELEN];
+	int pool_budget_mb;
+	int refs;		/* Holders, including "config" itself */
+};
+
+/* Buffer pool */
+#define POOL_NCLASSES		3
+#define POOL_MAX_SIZE		(MAXBUF > MAXLINE ? MAXBUF : MAXLINE)
+#define POOL_SLAB_SIZE		(128 * 1024)	/* Power of 2. */
+#define POOL_CACHE_MAX		16	/* Buffers per core and class. */
+#define POOL_BUDGET_MB		256	/* Default memory budget. */
+#define POOL_PRESSURE		90	/* Budget percentage that sheds load. */
+
+/*
+ * A slab is a POOL_SLAB_SIZE-aligned mapping carved into buffers of one
+ * size class, with this header at its start.  Free buffers are linked
+ * through their first word.
+ */
+struct slab {
+	struct slab *prev;	/* Class's list of slabs with free buffers */
+	struct slab *next;
+	void *free;
+	int class;
+	int nfree;
+	int nbufs;
+};
+
+/* One size class; "mutex" protects its slabs. */
+struct pool_class {
+	sem_t mutex;
+	struct slab *partial;
+	size_t size;
+};
+
+/* Per-core freelists that spare most allocations the class mutex. */
+struct pool_cache {
+	sem_t mutex;
+	void *free[POOL_NCLASSES];
+	int count[POOL_NCLASSES];
+} __attribute__((aligned(64)));
+
+/* Per-connection buffers, taken from the pool on first use */
+enum task_buffer {
+	TASK_BUF,		/* Request line and body relay */
+	TASK_URI,		/* Sized from the request line */
+	TASK_HOSTNAME,
+	TASK_PATHNAME,
+	TASK_HEADERS,
+	TASK_REQUEST,		/* Sized from its parts */
+	TASK_RESPONSE,
+	TASK_NBUFS
+};
+
+#define TASK_TOKENLEN	16	/* Room for the request method and version. */
+
+/* Request tracing */
+#define TRACE_RING_SIZE		4096	/* Finished traces kept (power of 2). */
+#define TRACE_URILEN		128	/* URI bytes kept per trace. */
+#define TRACE_MAGIC		0x52545850	/* "PXTR" in binary dumps. */
+#define TRACE_VERSION		1
+
+/*
+ * Points in a transaction at which a timestamp is taken.  Each span is
+ * named after the mark that ends it and starts at the preceding mark.
+ */
+enum trace_mark {
+	TRACE_START,		/* Thread picked up the connection */
+	TRACE_HEADERS,		/* Request line and headers read */
+	TRACE_DNS,		/* Server name resolved */
+	TRACE_CONNECT,		/* Connected to the server */
+	TRACE_FIRST_BYTE,	/* Request sent and response headers read */
+	TRACE_RELAY,		/* Response body relayed */
+	TRACE_NMARKS
+};
+
+/*
+ * One traced transaction.  Filled in on the worker's stack and copied into
+ * the ring when the transaction ends; a zero timestamp is a missed mark.
+ */
+struct trace_record {
+	unsigned long seq;	/* Ring ticket + 1; 0 while being written */
+	int reqnum;
+	in_addr_t addr;
+	uint64_t ts[TRACE_NMARKS];
+	char uri[TRACE_URILEN];
+};
+
+/*
+ * Per-client admission state.  Entries are reachable from the client table
+ * without locks; "conns" drops to -1 once the entry has expired so that a
+ * racing lookup can tell it must not be reused.
+ */
+struct client {
+	struct client *next;	/* Bucket chain */
+	struct client *retired;	/* Deferred free list */
+	in_addr_t addr;
+	int conns;		/* Open connections, -1 once expired */
+	double last_seen;
+	sem_t bucket_mutex;	/* Protects the token buckets */
+	double req_tokens;
+	double byte_tokens;
+	double last_refill;
+};
+
+/* One shard of the client table; "mutex" serializes writers only. */
+struct client_shard {
+	sem_t mutex;
+	struct client *buckets[ADMIT_BUCKETS];
+	struct client *retired;
+};
+
 /* Task args */
 struct task {
 	int fd;
 	struct sockaddr_in sockaddr;
+	struct client *client;	/* Admission state of the requester */
+	struct config *config;	/* Configuration for this transaction */
+	char *bufs[TASK_NBUFS];	/* Pool buffers in use, or NULL */
 };
 
 /* List structure for multiple buffer parsing consequences */
@@ -38,19 +223,70 @@ static int reqcount;
 /* Log file */
 FILE *pLog;
 
+/* Admission control state */
+static struct client_shard client_table[ADMIT_SHARDS];
+static int inflight;
+static double last_expiry;
+
+/* Configuration state */
+static struct config *config;
+static int config_readers;	/* Threads between loading and pinning "config" */
+static const char *config_path;
+
+/* Buffer pool state */
+static struct pool_class pool_classes[POOL_NCLASSES];
+static struct pool_cache *pool_caches;
+static int pool_ncaches;
+static size_t pool_mapped;	/* Bytes in slabs */
+static size_t pool_active;	/* Bytes handed out */
+static unsigned long pool_allocs, pool_cache_hits, pool_failures;
+static unsigned long pool_slab_maps, pool_slab_unmaps;
+
+/* Tracing state */
+static struct trace_record trace_ring[TRACE_RING_SIZE];
+static unsigned long trace_head;	/* Next ring ticket */
+static double trace_ns_per_tick = 1.0;
+static __thread struct trace_record *trace_current;
+static const char *const trace_span_names[TRACE_NMARKS] = {
+	"start", "headers", "dns", "connect", "first_byte", "relay"
+};
+
+/* Shutdown state */
+static int drain_pipe[2];	/* Written to stop the accept loop */
+
+/*
+ * Canned rejection responses, sent as-is so that turning a client away
+ * costs a single non-blocking send().
+ */
+static const char admit_busy_response[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Content-type: text/plain\r\n"
+    "Content-length: 20\r\n"
+    "Retry-After: 1\r\n"
+    "\r\n"
+    "Proxy is overloaded\n";
+static const char admit_limited_response[] =
+    "HTTP/1.0 429 Too Many Requests\r\n"
+    "Content-type: text/plain\r\n"
+    "Content-length: 18\r\n"
+    "Retry-After: 1\r\n"
+    "\r\n"
+    "Too many requests\n";
+
 /*
  * Function prototypes
  */
 
 void do_Proxy(struct task *thread_task, const int reqnum);
-void read_headers(rio_t *rp, char *headers, int *length, int *chunked);
+int read_headers(rio_t *rp, char *headers, size_t size, int *length,
+	int *chunked);
 int parse_uri(char *uri, char *target_addr, char *path, int *port);
 int parse_chunked_headers(char *chunked_header);
 static void client_error(int fd, const char *cause,
 	int err_num, const char *short_msg, const char *long_msg);
 
 static char    *create_log_entry(const struct sockaddr_in *sockaddr,
-		    const char *uri, int size);
+		    const char *uri, long long size);
 
 void *thread(void *vargp);
 ssize_t Rio_writen_w(int fd, void *usrbuf, size_t n);
@@ -58,6 +294,66 @@ ssize_t Rio_readnb_w(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen);
 int open_clientfd_ts(char *hostname, int port);
 
+/* For admission control */
+static double now_monotonic(void);
+static void admit_init(void);
+static int admit_acquire(const struct config *conf,
+	const struct sockaddr_in *sockaddr, struct client **clientp);
+static void admit_release(struct client *client);
+static void admit_charge(const struct config *conf, struct client *client,
+	size_t size);
+static void client_refill(const struct config *conf, struct client *client,
+	double now);
+static void admit_reject(int fd, int status);
+static struct client *client_lookup(struct client_shard *shard, in_addr_t addr);
+static struct client *client_insert(const struct config *conf,
+	struct client_shard *shard, in_addr_t addr);
+static void client_expire(const struct config *conf, double now);
+
+/* For configuration */
+static struct config *config_load(const char *path, const char *port);
+static int config_set(struct config *conf, const char *key, const char *value);
+static struct config *config_acquire(void);
+static void config_release(struct config *conf);
+static void config_publish(struct config *conf);
+static void config_reload(void);
+static void *signal_thread(void *vargp);
+static void set_io_timeout(int fd, int seconds);
+static int open_listen_addr(const char *address);
+
+/* For graceful restart */
+static void drain_start(void);
+static void drain_wait(void);
+static int upgrade_receive(const char *path);
+static void *upgrade_thread(void *vargp);
+static int send_fd(int sock, int fd);
+static int recv_fd(int sock);
+
+/* For the buffer pool */
+static void pool_init(void);
+static void *pool_alloc(size_t size);
+static void pool_free(void *buf);
+static int pool_pressure(const struct config *conf);
+static void pool_report(void);
+static struct slab *slab_create(int class);
+static void slab_free(void *buf);
+static void pool_trim(void);
+static char *task_buffer(struct task *thread_task, enum task_buffer which,
+	size_t size);
+static void task_buffer_release(struct task *thread_task,
+	enum task_buffer which);
+static int wait_readable(int fd, int seconds);
+static void relay_write(struct task *thread_task, void *buf, size_t n);
+
+/* For request tracing */
+static void trace_init(void);
+static uint64_t trace_now(void);
+static void trace_mark(enum trace_mark mark);
+static void trace_end(void);
+static void trace_log_fields(char *fields, size_t len);
+static void trace_dump(void);
+static int trace_snapshot(struct trace_record **recordsp);
+
 /* For list interface */
 struct List* list_create(void);
 void list_insert(struct List* lp, char* newelem);
@@ -68,49 +364,137 @@ char* list_totalstring(struct List* lp);
  * main
  *
  * Requires:
- *   Only one argument, the port number, must be specified.
+ *   The port number must be specified, optionally followed by the path of
+ *   a configuration file.
  *
  * Effects:
  *   Runs a master proxy server that handles different requests from
- *   various locations concurrently.
+ *   various locations concurrently.  On SIGHUP, the configuration file is
+ *   reloaded without interrupting transactions in progress.  On SIGTERM,
+ *   or after handing the listening socket to a new proxy process, stops
+ *   accepting and exits once transactions in progress finish.
  */
 int main(int argc, char **argv)
 {
-    int listenfd, connfd, port;
+    int listenfd, connfd, port, status;
     socklen_t clientlen;
     pthread_t tid;
+    sigset_t mask;
+    struct pollfd pfds[2];
+    struct config *conf;
 
 		// pid_t pid;
     struct sockaddr_in clientaddr;
+    struct client *client;
 
     /* Check arguments */
-    if (argc != 2) {
-    	fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+    	fprintf(stderr, "Usage: %s <port number> [config file]\n", argv[0]);
     	exit(0);
     }
     port = atoi(argv[1]);
 
+    /* Load configuration */
+    config_path = argc == 3 ? argv[2] : NULL;
+    if ((config = config_load(config_path, argv[1])) == NULL)
+    	exit(1);
+    config->refs = 1;
+
     /* Initial mutex */
     Sem_init(&open_clientfd_mutex, 0, 1);
     Sem_init(&log_mutex, 0, 1);
+    admit_init();
+    pool_init();
+    trace_init();
 
     /* Ignore SIGPIPE signals */
     Signal(SIGPIPE, SIG_IGN);
 
+    /* drain_start() wakes the accept loop through this pipe */
+    if (pipe(drain_pipe) < 0)
+    	unix_error("Pipe error");
+
+    /*
+     * Handle SIGHUP, SIGTERM and SIGUSR2 in a dedicated thread; every other
+     * thread blocks them.
+     */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    Pthread_create(&tid, NULL, signal_thread, NULL);
+
+    /* Listen, taking over the socket of a running proxy if there is one */
+    listenfd = -1;
+    if (config->upgrade_socket[0] != '\0')
+    	listenfd = upgrade_receive(config->upgrade_socket);
+    if (listenfd < 0)
+    	listenfd = open_listen_addr(config->listen);
+    if (listenfd < 0) {
+    	fprintf(stderr, "Cannot listen on %s\n", config->listen);
+    	exit(1);
+    }
 
-    /* Listen */
-    listenfd = Open_listenfd(argv[1]);
+    /*
+     * Another process may accept from the same socket, so a connection
+     * that poll() reported can be gone by the time accept() runs.
+     */
+    if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) < 0)
+    	unix_error("Fcntl error");
+    if (config->upgrade_socket[0] != '\0')
+    	Pthread_create(&tid, NULL, upgrade_thread, (void *)(intptr_t)listenfd);
     printf("Proxy is running...\n");
+    pfds[0].fd = listenfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = drain_pipe[0];
+    pfds[1].events = POLLIN;
     while (1) {
+      if (poll(pfds, 2, -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        unix_error("Poll error");
+      }
+      if (pfds[1].revents != 0)
+        break;
       clientlen = sizeof(clientaddr);
-      connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+      if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN ||
+            errno == EWOULDBLOCK)
+          continue;
+        unix_error("Accept error");
+      }
+      conf = config_acquire();
+			/* Turn the client away before spending a thread on it */
+      if ((status = admit_acquire(conf, &clientaddr, &client)) != ADMIT_OK) {
+        config_release(conf);
+        admit_reject(connfd, status);
+        Close(connfd);
+        continue;
+      }
 			/* Pass args */
-      struct task *vargp= (struct task *) Malloc(sizeof(struct task));
+      struct task *vargp= (struct task *) pool_alloc(sizeof(struct task));
+      if (vargp == NULL) {
+        admit_release(client);
+        config_release(conf);
+        admit_reject(connfd, ADMIT_BUSY);
+        Close(connfd);
+        continue;
+      }
+      memset(vargp->bufs, 0, sizeof(vargp->bufs));
       vargp->fd = connfd;
       vargp->sockaddr = clientaddr;
+      vargp->client = client;
+      vargp->config = conf;
 			/* Create thread */
       Pthread_create(&tid, NULL, thread, vargp);
     }
+
+    /*
+     * Stop accepting, but keep "listenfd" open until exit: the upgrade
+     * thread may still hand it to a new process while this one drains.
+     */
+    drain_wait();
     exit(0);
 }
 
@@ -121,15 +505,35 @@ int main(int argc, char **argv)
 		namely "struct task."
 	Effects:
 		For this thread, execute the proxy task, close all open file descriptors,
-		free the argument object, and terminate the thread.
+		release the client's admission slot, return the argument object and
+		its buffers to the pool, and terminate the thread.  Traces the task
+		if it is sampled.
 */
 void *thread(void *vargp)
 {
 	Pthread_detach(pthread_self());
 	struct task *thread_task = (struct task *) vargp;
-	do_Proxy(thread_task, reqcount++);
+	struct trace_record trace;
+	int i;
+	int reqnum = __atomic_fetch_add(&reqcount, 1, __ATOMIC_RELAXED);
+	int sample = thread_task->config->trace_sample;
+
+	if (sample > 0 && reqnum % sample == 0) {
+		memset(&trace, 0, sizeof(trace));
+		trace.reqnum = reqnum;
+		trace.addr = thread_task->sockaddr.sin_addr.s_addr;
+		trace_current = &trace;
+		trace_mark(TRACE_START);
+	}
+	do_Proxy(thread_task, reqnum);
+	if (trace_current != NULL)
+		trace_end();
 	close(thread_task->fd);
-  Free(vargp);
+	admit_release(thread_task->client);
+	config_release(thread_task->config);
+	for (i = 0; i < TASK_NBUFS; i++)
+		task_buffer_release(thread_task, i);
+	pool_free(vargp);
 	return(NULL);
 }
 
@@ -150,15 +554,20 @@ void *thread(void *vargp)
 void do_Proxy(struct task *thread_task, const int reqnum)
 {
     int serverfd, port, content_length, chunked_encode, chunked_length;
-		int size = 0;
+		int left_length, handle_length;
+		long long size = 0;
 		int fd;
-		char hostname[MAXLINE], pathname[MAXLINE], buf[MAXLINE], method[MAXLINE];
-		char uri[MAXLINE], version[MAXLINE];
-    char headers[MAXBUF], request[MAXBUF], response[MAXBUF];
+		char method[TASK_TOKENLEN], version[TASK_TOKENLEN];
+		char *uri, *hostname, *pathname;	/* From the pool */
+		char *buf, *headers, *request, *response;
+		size_t linelen, reqlen;
 		char *logstring;
+		char trace_fields[256];
 		rio_t rio_client, rio_server;
+		const struct config *conf = thread_task->config;
 
 		fd = thread_task->fd;
+		set_io_timeout(fd, conf->io_timeout);
 
 		/* Client tracking */
 		char client_ip_dec[INET_ADDRSTRLEN]; // client's IP address string
@@ -169,6 +578,14 @@ void do_Proxy(struct task *thread_task, const int reqnum)
 			printf("Corrupt request: %d\n", reqnum);
 			return;
 		}
+    /* Only take a buffer once the client has sent something */
+    if (wait_readable(fd, conf->io_timeout) <= 0) {
+		printf("Request %d: no request received\n", reqnum);
+		return;
+    }
+    if ((buf = task_buffer(thread_task, TASK_BUF, POOL_MAX_SIZE)) == NULL)
+		return;
+
     /* Read request line and headers */
     Rio_readinitb(&rio_client, fd);
 
@@ -195,8 +612,20 @@ void do_Proxy(struct task *thread_task, const int reqnum)
 		char* totalbuf = list_totalstring(readlist);
 		printf("total string: %s", totalbuf);
 
+    /* The URI and the names parsed from it are no longer than the line */
+    linelen = strlen(totalbuf) + 1;
+    if ((uri = task_buffer(thread_task, TASK_URI, linelen)) == NULL ||
+        (hostname = task_buffer(thread_task, TASK_HOSTNAME, linelen)) == NULL ||
+        (pathname = task_buffer(thread_task, TASK_PATHNAME, linelen)) == NULL) {
+		free(totalbuf);
+		list_destroy(readlist);
+		return;
+    }
+
     /* Get request type*/
-    sscanf(totalbuf, "%s %s %s", method, uri, version);
+    method[0] = uri[0] = version[0] = '\0';
+    sscanf(totalbuf, "%15s %s %15s", method, uri, version);
+    free(totalbuf);
     if (strcmp(method, "POST") && strcmp(method, "GET")) {
         client_error(fd, uri, 502, "Proxy error",
 					"Proxy doesn't implement this method");
@@ -207,7 +636,18 @@ void do_Proxy(struct task *thread_task, const int reqnum)
 		list_destroy(readlist);
 
     /* Get full headers */
-    read_headers(&rio_client, headers, &content_length, &chunked_encode);
+    if ((headers = task_buffer(thread_task, TASK_HEADERS, POOL_MAX_SIZE)) == NULL)
+		return;
+    if (read_headers(&rio_client, headers, POOL_MAX_SIZE, &content_length,
+        &chunked_encode) == -1) {
+        client_error(fd, uri, 400, "Bad Request",
+            "Cannot read the request headers");
+        return;
+    }
+    trace_mark(TRACE_HEADERS);
+    if (trace_current != NULL)
+	snprintf(trace_current->uri, TRACE_URILEN, "%.*s", TRACE_URILEN - 1,
+	    uri);
 
     /* Parse URI from request */
     if (parse_uri(uri, hostname, pathname, &port) == -1) {
@@ -226,12 +666,18 @@ void do_Proxy(struct task *thread_task, const int reqnum)
 	}
 
     /* Build HTTP request */
-    sprintf(request, "%s /%s %s\r\n%s", method, pathname, version, headers);
+    reqlen = strlen(method) + strlen(pathname) + strlen(version) +
+        strlen(headers) + sizeof(" / \r\n");
+    if ((request = task_buffer(thread_task, TASK_REQUEST, reqlen)) == NULL)
+		return;
+    snprintf(request, reqlen, "%s /%s %s\r\n%s", method, pathname, version,
+        headers);
 
     /* Send HTTP resquest to the web server */
     if ((serverfd = open_clientfd_ts(hostname, port)) == -1) {
 			return;
 	}
+	set_io_timeout(serverfd, conf->io_timeout);
 		
     if (Rio_writen_w(serverfd, request, strlen(request)) < 0) {
 		/* Writing to server fails */
@@ -239,10 +685,28 @@ void do_Proxy(struct task *thread_task, const int reqnum)
 		close(serverfd);
 		return;
 	}
+
+    /* Only the URI is needed past this point */
+    task_buffer_release(thread_task, TASK_HEADERS);
+    task_buffer_release(thread_task, TASK_REQUEST);
+    task_buffer_release(thread_task, TASK_HOSTNAME);
+    task_buffer_release(thread_task, TASK_PATHNAME);
 	
     if (strcmp(method, "POST") == 0) {	/* POST request */
-    	Rio_readnb_w(&rio_client, buf, content_length);
-    	Rio_writen_w(serverfd, buf, content_length);
+		/* Relay the body a buffer at a time. */
+		for (left_length = content_length; left_length > 0;
+		    left_length -= handle_length) {
+			handle_length = left_length > conf->relay_buf_size ?
+			    conf->relay_buf_size : left_length;
+			if (Rio_readnb_w(&rio_client, buf, handle_length) !=
+			    handle_length) {
+				printf("Request %d: short read from client\n",
+				    reqnum);
+				close(serverfd);
+				return;
+			}
+			Rio_writen_w(serverfd, buf, handle_length);
+		}
     }
 
 		/** End of Request Handling **/
@@ -254,10 +718,22 @@ void do_Proxy(struct task *thread_task, const int reqnum)
 
     /* Get response header */
     Rio_readinitb(&rio_server, serverfd);
-    read_headers(&rio_server, response, &content_length, &chunked_encode);
+    if ((response = task_buffer(thread_task, TASK_RESPONSE,
+        POOL_MAX_SIZE)) == NULL) {
+		close(serverfd);
+		return;
+    }
+    if (read_headers(&rio_server, response, POOL_MAX_SIZE, &content_length,
+        &chunked_encode) == -1) {
+		client_error(fd, uri, 502, "Bad Gateway",
+		    "Cannot read the response headers");
+		close(serverfd);
+		return;
+    }
+    trace_mark(TRACE_FIRST_BYTE);
 
     /* Send HTTP response to the client */
-    Rio_writen_w(fd, response, strlen(response));
+    relay_write(thread_task, response, strlen(response));
 		size = strlen(response);
 
     /* Send response content to the client */
@@ -269,72 +745,98 @@ void do_Proxy(struct task *thread_task, const int reqnum)
 			close(serverfd);
 			return;
 		}
-		Rio_writen_w(fd, buf, strlen(buf));
+		relay_write(thread_task, buf, strlen(buf));
     	while ((chunked_length = parse_chunked_headers(buf)) > 0) {
-			size += chunked_length;
-    		Rio_readnb_w(&rio_server, buf, chunked_length);
+			/* Relay the chunk a buffer at a time. */
+			for (left_length = chunked_length; left_length > 0;
+			    left_length -= handle_length) {
+				handle_length = left_length > conf->relay_buf_size ?
+				    conf->relay_buf_size : left_length;
+				if (Rio_readnb_w(&rio_server, buf, handle_length) !=
+				    handle_length) {
+					printf("Request %d: short read from server\n",
+					    reqnum);
+					close(serverfd);
+					return;
+				}
+				size += handle_length;
+				relay_write(thread_task, buf, handle_length);
+			}
 			printf("chunk fd: %d\n", fd);
-			Rio_writen_w(fd, buf, chunked_length);
 			if (Rio_readlineb_w(&rio_server, buf, MAXLINE) <= 0) {
 				printf("error after first one in the while loop\n");
 				close(serverfd);
 				return;
 			}
-    		Rio_writen_w(fd, buf, strlen(buf));
+    		relay_write(thread_task, buf, strlen(buf));
 			if (Rio_readlineb_w(&rio_server, buf, MAXLINE) <= 0) {
 				printf("error after second one in the while loop\n");
 				close(serverfd);
 				return;
 			}
-			Rio_writen_w(fd, buf, strlen(buf));
+			relay_write(thread_task, buf, strlen(buf));
     	}
 			if (Rio_readlineb_w(&rio_server, buf, MAXLINE) <= 0) {
 				printf("error after third one in the while loop\n");
 				close(serverfd);
 				return;
 			}
-			Rio_writen_w(fd, buf, strlen(buf));
+			relay_write(thread_task, buf, strlen(buf));
     } 
 	else if (content_length > 0) {
 		/* Define length with Content-length */
 		printf("Content-length case\n");
-        int left_length = content_length;
-        int handle_length = 0;
+        left_length = content_length;
     	while (left_length > 0) {
-        handle_length = left_length > MAXBUF ? MAXBUF : left_length;
+        handle_length = left_length > conf->relay_buf_size ?
+            conf->relay_buf_size : left_length;
+		/* A short read means the server closed or timed out. */
+		if (Rio_readnb_w(&rio_server, buf, handle_length) != handle_length) {
+			printf("Request %d: short read from server\n", reqnum);
+			close(serverfd);
+			return;
+		}
         left_length -= handle_length;
 		size += handle_length;
-		Rio_readnb_w(&rio_server, buf, handle_length);
-        Rio_writen_w(fd, buf, handle_length);
+        relay_write(thread_task, buf, handle_length);
       }
     } 
 	else { /* Define length with closing connection */
-		while ((chunked_length = Rio_readlineb_w(&rio_server, buf, MAXBUF)) > 0) {
+		while ((chunked_length = Rio_readlineb_w(&rio_server, buf,
+		    conf->relay_buf_size)) > 0) {
 			size += chunked_length;
-			  Rio_writen_w(fd, buf, chunked_length);
+			  relay_write(thread_task, buf, chunked_length);
 		}
     }
 
-	printf("Request %d: Forwarded %d bytes from end server to client\n", reqnum, size);
+	printf("Request %d: Forwarded %lld bytes from end server to client\n", reqnum, size);
+	trace_mark(TRACE_RELAY);
 
     /* Write log file */
-    P(&log_mutex);
-
-    /* Open log file */
-    pLog = fopen("proxy.log", "a");
+    if (conf->log_enabled) {
 	logstring = create_log_entry(sockaddr, uri, size);
-    printf("log entry generated: %s\n", logstring);
+	printf("log entry generated: %s\n", logstring);
+	trace_fields[0] = '\0';
+	if (conf->trace_log_fields && trace_current != NULL)
+		trace_log_fields(trace_fields, sizeof(trace_fields));
+
+	P(&log_mutex);
+	/* Open log file */
+	if ((pLog = fopen(conf->log_path, "a")) != NULL) {
+		fprintf(pLog, "%s%s\n", logstring, trace_fields);
+		fclose(pLog);
+	} else
+		fprintf(stderr, "Cannot open log file %s: %s\n",
+		    conf->log_path, strerror(errno));
+	V(&log_mutex);
 
-    fprintf(pLog, "%s\n", logstring);
-    fclose(pLog);
-    V(&log_mutex);
+	/* Free dynamic variables */
+	free(logstring);
+    }
 
     /* Close connection to server */
     close(serverfd);
 
-	/* Free dynamic variables */
-	free(logstring);
-
 }
 
 /*
@@ -396,26 +898,58 @@ client_error(int fd, const char *cause, int err_num, const char *short_msg,
 /*
  * read_header - get request header
  *
- * Read headers of request. Return -1 if there is any problem.
+ * Read headers of request into "content", which holds "size" bytes.  Each
+ * line is read straight into the end of "content".  Return -1 if the
+ * headers cannot be read or do not fit, and 0 otherwise.
  */
- void read_headers(rio_t *rp, char *content, int *length, int *chunked)
+ int read_headers(rio_t *rp, char *content, size_t size, int *length,
+     int *chunked)
  {
-    char buf[MAXLINE];
+    static const char close_header[] = "Connection: close\r\n";
+    char *buf;
+    size_t used;
+    ssize_t n;
+    int done;
     *length = *chunked = 0;
+    content[0] = '\0';
 
-	if (Rio_readlineb_w(rp, buf, MAXLINE) <= 0) {
+	if ((n = Rio_readlineb_w(rp, content, size - sizeof(close_header))) <= 0) {
 		printf("error while reading header\n");
-		return;
+		return (-1);
+	}
+	/* A line that did not fit does not end in a newline. */
+	if (content[n - 1] != '\n') {
+		printf("headers too long\n");
+		return (-1);
+	}
+	/* No headers at all; the blank line goes after ours. */
+	if (strcmp(content, "\r\n") == 0) {
+		strcpy(content, close_header);
+		strcat(content, "\r\n");
+		return (0);
 	}
-	strcpy(content, buf);
 	
 	// tack on the connection: closed as per HTTP/1.1
-    strcat(content, "Connection: close\r\n");
-    while (strcmp(buf, "\r\n")) {
-		if (Rio_readlineb_w(rp, buf, MAXLINE) <= 0) {
+    strcpy(content + n, close_header);
+    used = n + sizeof(close_header) - 1;
+    done = 0;
+    while (!done) {
+		buf = content + used;
+		if (size - used < 2) {
+			printf("headers too long\n");
+			return (-1);
+		}
+		if ((n = Rio_readlineb_w(rp, buf, size - used)) <= 0) {
 			printf("error in the header's while loop\n");
-			return;
+			*buf = '\0';
+			return (-1);
+		}
+		if (buf[n - 1] != '\n') {
+			printf("headers too long\n");
+			*buf = '\0';
+			return (-1);
 		}
+		done = strcmp(buf, "\r\n") == 0;
 		/* Get 'Content-Length:' */
         if (strncasecmp(buf, "Content-Length:", 15) == 0)
             *length = atoi(buf + 15);
@@ -424,10 +958,13 @@ client_error(int fd, const char *cause, int err_num, const char *short_msg,
         	*chunked = 1;
         /* Remove 'Connection' and 'Proxy-Connection' */
         if (strncasecmp(buf, "Proxy-Connection:", 17) == 0
-							|| strncasecmp(buf, "Connection:", 11) == 0)
+							|| strncasecmp(buf, "Connection:", 11) == 0) {
+            *buf = '\0';
             continue;
-        strcat(content, buf);
+        }
+        used += n;
     }
+    return (0);
  }
 
 /*
@@ -591,6 +1128,7 @@ int open_clientfd_ts(char *hostname, int port)
     hp = (struct hostent*) malloc(sizeof(struct hostent));
     memcpy(hp, sharedp, sizeof(struct hostent));
     V(&open_clientfd_mutex);
+    trace_mark(TRACE_DNS);
     bzero((char *) &serveraddr, sizeof(serveraddr));
     serveraddr.sin_family = AF_INET;
     bcopy((char *)hp->h_addr_list[0],
@@ -601,6 +1139,7 @@ int open_clientfd_ts(char *hostname, int port)
     /* Establish a connection with the server */
     if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0)
     return -1;
+    trace_mark(TRACE_CONNECT);
     return clientfd;
 }
 
@@ -618,7 +1157,8 @@ int open_clientfd_ts(char *hostname, int port)
  *   the response from the server ("size").
  */
 static char *
-create_log_entry(const struct sockaddr_in *sockaddr, const char *uri, int size)
+create_log_entry(const struct sockaddr_in *sockaddr, const char *uri,
+    long long size)
 {
 
 	/*
@@ -649,11 +1189,1603 @@ create_log_entry(const struct sockaddr_in *sockaddr, const char *uri, int size)
 	/*
 	 * Add the URI and response size onto the end of the log entry.
 	 */
-	snprintf(&log_str[log_strlen], log_maxlen - log_strlen, " %s %d", uri, size);
+	snprintf(&log_str[log_strlen], log_maxlen - log_strlen, " %s %lld", uri, size);
 
 	return (log_str);
 }
 
+/*
+ * now_monotonic
+ *
+ * Effects:
+ *   Returns the current time of the monotonic clock in seconds.
+ */
+static double
+now_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * admit_init
+ *
+ * Effects:
+ *   Initializes the client table used for admission control.
+ */
+static void
+admit_init(void)
+{
+	int i;
+
+	for (i = 0; i < ADMIT_SHARDS; i++)
+		Sem_init(&client_table[i].mutex, 0, 1);
+	last_expiry = now_monotonic();
+}
+
+/*
+ * admit_acquire
+ *
+ * Requires:
+ *   The parameter "conf" must point to an acquired configuration.  The
+ *   parameter "sockaddr" must point to the address of a newly accepted
+ *   client.  Must only be called from the accept loop.
+ *
+ * Effects:
+ *   Decides whether the client may be served.  Enforces the global
+ *   in-flight and memory limits, the per-client concurrent connection
+ *   limit, and the per-client request and byte token buckets.  On success,
+ *   returns ADMIT_OK and stores the client's admission state in "*clientp";
+ *   the caller must eventually pass it to admit_release().  Otherwise,
+ *   returns the HTTP status with which the client should be turned away and
+ *   holds nothing.
+ */
+static int
+admit_acquire(const struct config *conf, const struct sockaddr_in *sockaddr,
+    struct client **clientp)
+{
+	in_addr_t addr = sockaddr->sin_addr.s_addr;
+	struct client_shard *shard;
+	struct client *client;
+	double now;
+	int conns, limited;
+
+	now = now_monotonic();
+	if (now - last_expiry >= 1.0) {
+		client_expire(conf, now);
+		last_expiry = now;
+	}
+
+	if (pool_pressure(conf))
+		return (ADMIT_BUSY);
+	if (__atomic_add_fetch(&inflight, 1, __ATOMIC_ACQ_REL) >
+	    conf->max_inflight) {
+		__atomic_sub_fetch(&inflight, 1, __ATOMIC_ACQ_REL);
+		return (ADMIT_BUSY);
+	}
+
+	shard = &client_table[CLIENT_SHARD(addr)];
+	for (;;) {
+		if ((client = client_lookup(shard, addr)) == NULL)
+			client = client_insert(conf, shard, addr);
+
+		/* Take a connection slot unless the entry has expired. */
+		conns = __atomic_load_n(&client->conns, __ATOMIC_ACQUIRE);
+		do {
+			if (conns < 0)
+				break;
+			if (conns >= conf->max_client_conns) {
+				__atomic_sub_fetch(&inflight, 1,
+				    __ATOMIC_ACQ_REL);
+				return (ADMIT_LIMITED);
+			}
+		} while (!__atomic_compare_exchange_n(&client->conns, &conns,
+		    conns + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+		if (conns >= 0)
+			break;
+	}
+
+	/* Refill and draw from the token buckets. */
+	P(&client->bucket_mutex);
+	client_refill(conf, client, now);
+	limited = client->req_tokens < 1.0 || client->byte_tokens <= 0.0;
+	if (!limited)
+		client->req_tokens -= 1.0;
+	V(&client->bucket_mutex);
+	client->last_seen = now;
+
+	if (limited) {
+		admit_release(client);
+		return (ADMIT_LIMITED);
+	}
+	*clientp = client;
+	return (ADMIT_OK);
+}
+
+/*
+ * admit_release
+ *
+ * Requires:
+ *   The parameter "client" must have been returned by admit_acquire() and
+ *   not yet released.
+ *
+ * Effects:
+ *   Gives back the connection slots taken by admit_acquire().
+ */
+static void
+admit_release(struct client *client)
+{
+
+	client->last_seen = now_monotonic();
+	__atomic_sub_fetch(&client->conns, 1, __ATOMIC_ACQ_REL);
+	__atomic_sub_fetch(&inflight, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * admit_charge
+ *
+ * Requires:
+ *   The parameter "client" must have been returned by admit_acquire() and
+ *   not yet released.
+ *
+ * Effects:
+ *   Charges "size" bytes about to be written to the client against its byte
+ *   bucket.  If that leaves the bucket negative, sleeps until it has
+ *   refilled to zero, so that a transfer in progress is paced to the
+ *   client's byte rate.
+ */
+static void
+admit_charge(const struct config *conf, struct client *client, size_t size)
+{
+	struct timespec delay;
+	double wait;
+
+	P(&client->bucket_mutex);
+	client_refill(conf, client, now_monotonic());
+	client->byte_tokens -= size;
+	wait = client->byte_tokens < 0.0 ?
+	    -client->byte_tokens / conf->byte_rate : 0.0;
+	V(&client->bucket_mutex);
+	if (wait > 0.0) {
+		delay.tv_sec = (time_t)wait;
+		delay.tv_nsec = (long)((wait - delay.tv_sec) * 1e9);
+		while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+			;
+	}
+}
+
+/*
+ * admit_reject
+ *
+ * Requires:
+ *   The parameter "fd" must be an open socket that is connected to the
+ *   client.  The parameter "status" must be ADMIT_BUSY or ADMIT_LIMITED.
+ *
+ * Effects:
+ *   Sends the canned rejection response for "status" without blocking.  A
+ *   client that cannot take the response immediately does not get it.
+ */
+static void
+admit_reject(int fd, int status)
+{
+	const char *response;
+	size_t len;
+
+	if (status == ADMIT_BUSY) {
+		response = admit_busy_response;
+		len = sizeof(admit_busy_response) - 1;
+	} else {
+		response = admit_limited_response;
+		len = sizeof(admit_limited_response) - 1;
+	}
+	if (send(fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		printf("Rejected client did not take the response: %s\n",
+		    strerror(errno));
+}
+
+/*
+ * client_refill
+ *
+ * Requires:
+ *   The caller must hold the bucket mutex of "client".
+ *
+ * Effects:
+ *   Adds the tokens that "client" has earned since its last refill, up to
+ *   the configured bursts.
+ */
+static void
+client_refill(const struct config *conf, struct client *client, double now)
+{
+	double elapsed;
+
+	elapsed = now - client->last_refill;
+	client->last_refill = now;
+	client->req_tokens += elapsed * conf->req_rate;
+	if (client->req_tokens > conf->req_burst)
+		client->req_tokens = conf->req_burst;
+	client->byte_tokens += elapsed * conf->byte_rate;
+	if (client->byte_tokens > conf->byte_burst)
+		client->byte_tokens = conf->byte_burst;
+}
+
+/*
+ * client_lookup
+ *
+ * Requires:
+ *   The parameter "shard" must be the shard that "addr" hashes to.
+ *
+ * Effects:
+ *   Returns the entry for "addr", or NULL if there is none.  Takes no
+ *   locks; writers publish entries with release stores and never free an
+ *   unlinked entry before the following expiry pass.
+ */
+static struct client *
+client_lookup(struct client_shard *shard, in_addr_t addr)
+{
+	struct client *client;
+
+	client = __atomic_load_n(&shard->buckets[CLIENT_BUCKET(addr)],
+	    __ATOMIC_ACQUIRE);
+	while (client != NULL && client->addr != addr)
+		client = __atomic_load_n(&client->next, __ATOMIC_ACQUIRE);
+	return (client);
+}
+
+/*
+ * client_insert
+ *
+ * Requires:
+ *   The parameter "conf" must point to an acquired configuration.  The
+ *   parameter "shard" must be the shard that "addr" hashes to.
+ *
+ * Effects:
+ *   Returns the entry for "addr", creating one with full token buckets if
+ *   there is none.
+ */
+static struct client *
+client_insert(const struct config *conf, struct client_shard *shard,
+    in_addr_t addr)
+{
+	struct client **bucket = &shard->buckets[CLIENT_BUCKET(addr)];
+	struct client *client;
+
+	P(&shard->mutex);
+	if ((client = client_lookup(shard, addr)) != NULL &&
+	    __atomic_load_n(&client->conns, __ATOMIC_ACQUIRE) >= 0) {
+		V(&shard->mutex);
+		return (client);
+	}
+	client = Malloc(sizeof(struct client));
+	client->addr = addr;
+	client->conns = 0;
+	client->retired = NULL;
+	Sem_init(&client->bucket_mutex, 0, 1);
+	client->req_tokens = conf->req_burst;
+	client->byte_tokens = conf->byte_burst;
+	client->last_refill = client->last_seen = now_monotonic();
+	client->next = *bucket;
+	__atomic_store_n(bucket, client, __ATOMIC_RELEASE);
+	V(&shard->mutex);
+	return (client);
+}
+
+/*
+ * client_expire
+ *
+ * Effects:
+ *   Frees the entries retired by the previous pass, then retires every
+ *   entry that has no open connections and has been idle for the
+ *   configured expiry time.  An entry is only retired if its connection
+ *   count can be swapped from 0 to -1, so it never races with
+ *   admit_acquire().
+ */
+static void
+client_expire(const struct config *conf, double now)
+{
+	struct client_shard *shard;
+	struct client **prevp, *client, *dead;
+	int i, j, idle;
+
+	for (i = 0; i < ADMIT_SHARDS; i++) {
+		shard = &client_table[i];
+		P(&shard->mutex);
+		while ((dead = shard->retired) != NULL) {
+			shard->retired = dead->retired;
+			sem_destroy(&dead->bucket_mutex);
+			Free(dead);
+		}
+		for (j = 0; j < ADMIT_BUCKETS; j++) {
+			prevp = &shard->buckets[j];
+			while ((client = *prevp) != NULL) {
+				idle = 0;
+				if (now - client->last_seen >= conf->client_expiry &&
+				    __atomic_compare_exchange_n(&client->conns,
+				    &idle, -1, 0, __ATOMIC_ACQ_REL,
+				    __ATOMIC_ACQUIRE)) {
+					__atomic_store_n(prevp, client->next,
+					    __ATOMIC_RELEASE);
+					client->retired = shard->retired;
+					shard->retired = client;
+				} else
+					prevp = &client->next;
+			}
+		}
+		V(&shard->mutex);
+	}
+}
+
+/*
+ * config_load
+ *
+ * Requires:
+ *   The parameter "port" must point to a properly NUL-terminated string.
+ *   The parameter "path" must be NULL or point to a properly NUL-terminated
+ *   string.
+ *
+ * Effects:
+ *   Returns a newly allocated configuration holding the defaults with the
+ *   settings from the file "path" applied on top.  The proxy listens on
+ *   "port" on all addresses unless the file sets "listen".  The file
+ *   consists of "key = value" lines; '#' starts a comment that runs to the
+ *   end of the line, and blank lines are ignored.  Returns NULL, leaving
+ *   nothing allocated, if the file cannot be read or contains an invalid
+ *   setting.
+ */
+static struct config *
+config_load(const char *path, const char *port)
+{
+	struct config *conf;
+	char line[MAXLINE], key[MAXLINE], value[MAXLINE];
+	FILE *fp;
+	char *comment;
+	int lineno = 0, end;
+
+	conf = Malloc(sizeof(struct config));
+	snprintf(conf->listen, sizeof(conf->listen), "%s", port);
+	conf->max_inflight = ADMIT_MAX_INFLIGHT;
+	conf->max_client_conns = ADMIT_MAX_CONNS;
+	conf->req_rate = ADMIT_REQ_RATE;
+	conf->req_burst = ADMIT_REQ_BURST;
+	conf->byte_rate = ADMIT_BYTE_RATE;
+	conf->byte_burst = ADMIT_BYTE_BURST;
+	conf->client_expiry = ADMIT_EXPIRY;
+	conf->relay_buf_size = MAXBUF;
+	conf->io_timeout = CONFIG_IO_TIMEOUT;
+	conf->log_enabled = 1;
+	snprintf(conf->log_path, sizeof(conf->log_path), "%s", CONFIG_LOG_PATH);
+	conf->upgrade_socket[0] = '\0';
+	conf->drain_timeout = CONFIG_DRAIN_TIMEOUT;
+	conf->trace_sample = 0;
+	conf->trace_log_fields = 0;
+	conf->trace_binary = 0;
+	snprintf(conf->trace_path, sizeof(conf->trace_path), "%s",
+	    CONFIG_TRACE_PATH);
+	conf->pool_budget_mb = POOL_BUDGET_MB;
+	conf->refs = 0;
+	if (path == NULL)
+		return (conf);
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Cannot open config file %s: %s\n", path,
+		    strerror(errno));
+		Free(conf);
+		return (NULL);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((comment = strchr(line, '#')) != NULL)
+			*comment = '\0';
+		if (sscanf(line, " %s", key) != 1)
+			continue;
+		/* The value must be the last thing on the line. */
+		end = 0;
+		if (sscanf(line, " %[^= \t] = %s %n", key, value, &end) != 2 ||
+		    line[end] != '\0' || config_set(conf, key, value) == -1) {
+			fprintf(stderr, "%s:%d: invalid setting: %s", path,
+			    lineno, line);
+			fclose(fp);
+			Free(conf);
+			return (NULL);
+		}
+	}
+	fclose(fp);
+	return (conf);
+}
+
+/*
+ * config_set
+ *
+ * Requires:
+ *   The parameters "key" and "value" must point to properly NUL-terminated
+ *   strings.
+ *
+ * Effects:
+ *   Sets the setting "key" of "conf" to "value".  Returns -1 if "key" is
+ *   unknown or "value" is out of range for it and 0 otherwise.
+ */
+static int
+config_set(struct config *conf, const char *key, const char *value)
+{
+	static const struct {
+		const char *key;
+		size_t offset;
+		int min, max;
+	} ints[] = {
+		{ "max_threads", offsetof(struct config, max_inflight),
+		    1, INT_MAX },
+		{ "max_client_conns", offsetof(struct config, max_client_conns),
+		    1, INT_MAX },
+		{ "client_req_rate", offsetof(struct config, req_rate),
+		    1, INT_MAX },
+		{ "client_req_burst", offsetof(struct config, req_burst),
+		    1, INT_MAX },
+		{ "client_byte_rate", offsetof(struct config, byte_rate),
+		    1, INT_MAX },
+		{ "client_byte_burst", offsetof(struct config, byte_burst),
+		    1, INT_MAX },
+		{ "client_expiry", offsetof(struct config, client_expiry),
+		    1, INT_MAX },
+		{ "relay_buffer_size", offsetof(struct config, relay_buf_size),
+		    CONFIG_RELAY_MIN, MAXBUF },
+		{ "io_timeout", offsetof(struct config, io_timeout),
+		    0, INT_MAX },
+		{ "log_enabled", offsetof(struct config, log_enabled), 0, 1 },
+		{ "drain_timeout", offsetof(struct config, drain_timeout),
+		    0, INT_MAX },
+		{ "trace_sample", offsetof(struct config, trace_sample),
+		    0, INT_MAX },
+		{ "trace_log_fields", offsetof(struct config, trace_log_fields),
+		    0, 1 },
+		{ "pool_budget_mb", offsetof(struct config, pool_budget_mb),
+		    1, INT_MAX / 2 },
+	};
+	char *end;
+	long n;
+	size_t i;
+
+	if (strcmp(key, "listen") == 0) {
+		if (strlen(value) >= sizeof(conf->listen))
+			return (-1);
+		strcpy(conf->listen, value);
+		return (0);
+	}
+	if (strcmp(key, "log_path") == 0) {
+		if (strlen(value) >= sizeof(conf->log_path))
+			return (-1);
+		strcpy(conf->log_path, value);
+		return (0);
+	}
+	if (strcmp(key, "trace_path") == 0) {
+		if (strlen(value) >= sizeof(conf->trace_path))
+			return (-1);
+		strcpy(conf->trace_path, value);
+		return (0);
+	}
+	if (strcmp(key, "trace_format") == 0) {
+		if (strcmp(value, "json") == 0)
+			conf->trace_binary = 0;
+		else if (strcmp(value, "binary") == 0)
+			conf->trace_binary = 1;
+		else
+			return (-1);
+		return (0);
+	}
+	if (strcmp(key, "upgrade_socket") == 0) {
+		if (strlen(value) >= sizeof(conf->upgrade_socket) ||
+		    strlen(value) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+			return (-1);
+		strcpy(conf->upgrade_socket, value);
+		return (0);
+	}
+	for (i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) {
+		if (strcmp(key, ints[i].key) != 0)
+			continue;
+		errno = 0;
+		n = strtol(value, &end, 10);
+		if (errno != 0 || *end != '\0' || n < ints[i].min ||
+		    n > ints[i].max)
+			return (-1);
+		*(int *)((char *)conf + ints[i].offset) = n;
+		return (0);
+	}
+	return (-1);
+}
+
+/*
+ * config_acquire
+ *
+ * Effects:
+ *   Returns the current configuration, which stays valid until it is
+ *   passed to config_release().  Never blocks on a concurrent reload.
+ */
+static struct config *
+config_acquire(void)
+{
+	struct config *conf;
+
+	/*
+	 * "config_readers" tells config_publish() that a thread may have
+	 * loaded the old pointer without having pinned it yet.
+	 */
+	__atomic_add_fetch(&config_readers, 1, __ATOMIC_SEQ_CST);
+	conf = __atomic_load_n(&config, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&conf->refs, 1, __ATOMIC_ACQ_REL);
+	__atomic_sub_fetch(&config_readers, 1, __ATOMIC_SEQ_CST);
+	return (conf);
+}
+
+/*
+ * config_release
+ *
+ * Requires:
+ *   The parameter "conf" must have been returned by config_acquire().
+ *
+ * Effects:
+ *   Drops a reference to "conf", freeing it if it has been replaced and
+ *   this was the last one.
+ */
+static void
+config_release(struct config *conf)
+{
+
+	if (__atomic_sub_fetch(&conf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		Free(conf);
+}
+
+/*
+ * config_publish
+ *
+ * Requires:
+ *   The parameter "conf" must have been returned by config_load().  Must
+ *   only be called from one thread at a time.
+ *
+ * Effects:
+ *   Makes "conf" the current configuration.  The previous configuration is
+ *   freed once the last transaction using it releases it.
+ */
+static void
+config_publish(struct config *conf)
+{
+	struct config *old;
+
+	conf->refs = 1;
+	old = __atomic_exchange_n(&config, conf, __ATOMIC_SEQ_CST);
+
+	/*
+	 * Wait out readers that may still be about to pin "old".  This window
+	 * is a few instructions long and only the reloading thread waits.
+	 */
+	while (__atomic_load_n(&config_readers, __ATOMIC_SEQ_CST) != 0)
+		sched_yield();
+	config_release(old);
+}
+
+/*
+ * config_reload
+ *
+ * Effects:
+ *   Rereads the configuration file and publishes the result.  Keeps the
+ *   current configuration if the file is invalid.  The listening address
+ *   and upgrade socket cannot change without a restart.
+ */
+static void
+config_reload(void)
+{
+	struct config *conf, *cur;
+
+	if (config_path == NULL) {
+		printf("No config file to reload\n");
+		return;
+	}
+	cur = config_acquire();
+	conf = config_load(config_path, cur->listen);
+	if (conf == NULL) {
+		printf("Keeping current configuration\n");
+		config_release(cur);
+		return;
+	}
+	if (strcmp(conf->listen, cur->listen) != 0) {
+		printf("Ignoring new listen address %s until restart\n",
+		    conf->listen);
+		strcpy(conf->listen, cur->listen);
+	}
+	strcpy(conf->upgrade_socket, cur->upgrade_socket);
+	config_release(cur);
+	config_publish(conf);
+	printf("Reloaded configuration from %s\n", config_path);
+}
+
+/*
+ * signal_thread
+ *
+ * Requires:
+ *   The signals it waits for must be blocked in every thread.
+ *
+ * Effects:
+ *   Handles SIGHUP synchronously by reloading the configuration, SIGTERM
+ *   by draining the proxy, and SIGUSR2 by dumping the trace ring and
+ *   reporting buffer pool statistics.  Never returns.
+ */
+static void *
+signal_thread(void *vargp)
+{
+	sigset_t mask;
+	int sig;
+
+	(void)vargp;
+	Pthread_detach(pthread_self());
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR2);
+	for (;;) {
+		if (sigwait(&mask, &sig) != 0)
+			continue;
+		if (sig == SIGHUP)
+			config_reload();
+		else if (sig == SIGTERM)
+			drain_start();
+		else if (sig == SIGUSR2) {
+			trace_dump();
+			pool_report();
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * set_io_timeout
+ *
+ * Requires:
+ *   The parameter "fd" must be an open socket.
+ *
+ * Effects:
+ *   Makes reads and writes on "fd" fail after "seconds" seconds without
+ *   progress.  Does nothing if "seconds" is 0.
+ */
+static void
+set_io_timeout(int fd, int seconds)
+{
+	struct timeval tv;
+
+	if (seconds == 0)
+		return;
+	tv.tv_sec = seconds;
+	tv.tv_usec = 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+		fprintf(stderr, "setsockopt error: %s\n", strerror(errno));
+}
+
+/*
+ * open_listen_addr
+ *
+ * Requires:
+ *   The parameter "address" must point to a properly NUL-terminated string
+ *   of the form "port" or "host:port".
+ *
+ * Effects:
+ *   Returns a socket listening on "address", on every IPv4 address if no
+ *   host is given.  Returns -1 on Unix error and -2 if "address" cannot be
+ *   resolved.
+ */
+static int
+open_listen_addr(const char *address)
+{
+	struct addrinfo hints, *list, *p;
+	char host[CONFIG_NAMELEN];
+	const char *port, *colon;
+	int listenfd = -1, optval = 1;
+
+	if ((colon = strrchr(address, ':')) != NULL) {
+		snprintf(host, sizeof(host), "%.*s", (int)(colon - address),
+		    address);
+		port = colon + 1;
+	} else
+		port = address;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV | AI_ADDRCONFIG;
+	if (getaddrinfo(colon != NULL ? host : NULL, port, &hints, &list) != 0)
+		return (-2);
+	for (p = list; p != NULL; p = p->ai_next) {
+		if ((listenfd = socket(p->ai_family, p->ai_socktype,
+		    p->ai_protocol)) < 0)
+			continue;
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval,
+		    sizeof(optval));
+		if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0 &&
+		    listen(listenfd, LISTENQ) == 0)
+			break;
+		close(listenfd);
+		listenfd = -1;
+	}
+	freeaddrinfo(list);
+	return (listenfd);
+}
+
+/*
+ * drain_start
+ *
+ * Effects:
+ *   Wakes the accept loop and tells it to stop.  Safe to call more than
+ *   once.
+ */
+static void
+drain_start(void)
+{
+	char byte = 0;
+
+	if (write(drain_pipe[1], &byte, 1) < 0)
+		fprintf(stderr, "Cannot stop accept loop: %s\n",
+		    strerror(errno));
+}
+
+/*
+ * drain_wait
+ *
+ * Effects:
+ *   Waits until every admitted transaction has finished, or until the
+ *   configured drain timeout expires, whichever comes first.
+ */
+static void
+drain_wait(void)
+{
+	struct config *conf;
+	double deadline;
+	int left;
+
+	conf = config_acquire();
+	deadline = now_monotonic() + conf->drain_timeout;
+	config_release(conf);
+
+	printf("Draining...\n");
+	while ((left = __atomic_load_n(&inflight, __ATOMIC_ACQUIRE)) > 0) {
+		if (now_monotonic() >= deadline) {
+			printf("Drain timeout with %d transactions left\n",
+			    left);
+			return;
+		}
+		usleep(100000);
+	}
+	printf("Drained\n");
+}
+
+/*
+ * upgrade_receive
+ *
+ * Requires:
+ *   The parameter "path" must point to a properly NUL-terminated string
+ *   that fits in a Unix domain socket address.
+ *
+ * Effects:
+ *   Asks the proxy serving the upgrade socket "path" for its listening
+ *   socket.  On success, acknowledges receipt, after which the old proxy
+ *   stops accepting, and returns the socket.  Returns -1 if no proxy is
+ *   serving "path" or the handoff fails or takes longer than
+ *   UPGRADE_TIMEOUT seconds.
+ */
+static int
+upgrade_receive(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock, fd;
+	char ack = 1;
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return (-1);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(sock, (SA *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return (-1);
+	}
+	set_io_timeout(sock, UPGRADE_TIMEOUT);
+	if ((fd = recv_fd(sock)) < 0) {
+		fprintf(stderr, "Listening socket handoff failed\n");
+		close(sock);
+		return (-1);
+	}
+	if (rio_writen(sock, &ack, 1) != 1) {
+		fprintf(stderr, "Listening socket handoff not acknowledged\n");
+		close(fd);
+		close(sock);
+		return (-1);
+	}
+	close(sock);
+	printf("Took over listening socket from %s\n", path);
+	return (fd);
+}
+
+/*
+ * upgrade_thread
+ *
+ * Requires:
+ *   The parameter "vargp" must be the listening socket, cast to a pointer.
+ *
+ * Effects:
+ *   Serves the configured upgrade socket, which only its owner may use.
+ *   Hands the listening socket to the first process of the same user that
+ *   connects and acknowledges it, then drains this proxy.  Exits the
+ *   thread without draining if the upgrade socket cannot be set up.
+ */
+static void *
+upgrade_thread(void *vargp)
+{
+	struct sockaddr_un addr;
+	struct config *conf;
+	struct ucred cred;
+	socklen_t credlen;
+	int listenfd = (int)(intptr_t)vargp;
+	int sock, connfd;
+	char ack;
+
+	Pthread_detach(pthread_self());
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	conf = config_acquire();
+	strcpy(addr.sun_path, conf->upgrade_socket);
+	config_release(conf);
+
+	/* Any previous owner of the path has already handed off or died. */
+	unlink(addr.sun_path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    bind(sock, (SA *)&addr, sizeof(addr)) < 0 ||
+	    chmod(addr.sun_path, S_IRUSR | S_IWUSR) < 0 ||
+	    listen(sock, 1) < 0) {
+		fprintf(stderr, "Cannot serve upgrade socket %s: %s\n",
+		    addr.sun_path, strerror(errno));
+		if (sock >= 0)
+			close(sock);
+		return (NULL);
+	}
+	for (;;) {
+		if ((connfd = accept(sock, NULL, NULL)) < 0)
+			continue;
+
+		/* Only hand the socket to a process of our own user. */
+		credlen = sizeof(cred);
+		if (getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &cred,
+		    &credlen) < 0 || cred.uid != getuid()) {
+			fprintf(stderr, "Refusing handoff to another user\n");
+			close(connfd);
+			continue;
+		}
+		set_io_timeout(connfd, UPGRADE_TIMEOUT);
+		if (send_fd(connfd, listenfd) == 0 &&
+		    rio_readn(connfd, &ack, 1) == 1)
+			break;
+		fprintf(stderr, "Listening socket handoff failed\n");
+		close(connfd);
+	}
+
+	/* The new process owns the path now, so do not unlink it. */
+	close(connfd);
+	close(sock);
+	printf("Handed off listening socket\n");
+	drain_start();
+	return (NULL);
+}
+
+/*
+ * send_fd
+ *
+ * Requires:
+ *   The parameter "sock" must be a connected Unix domain socket and "fd"
+ *   must be an open file descriptor.
+ *
+ * Effects:
+ *   Sends a duplicate of "fd" over "sock".  Returns 0 on success and -1
+ *   otherwise.
+ */
+static int
+send_fd(int sock, int fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	char byte = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return (sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1);
+}
+
+/*
+ * recv_fd
+ *
+ * Requires:
+ *   The parameter "sock" must be a connected Unix domain socket.
+ *
+ * Effects:
+ *   Receives a file descriptor sent by send_fd() over "sock" and returns
+ *   it.  Returns -1 if none arrives.
+ */
+static int
+recv_fd(int sock)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	char byte;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(sock, &msg, 0) != 1)
+		return (-1);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		return (-1);
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return (fd);
+}
+
+/*
+ * trace_init
+ *
+ * Effects:
+ *   Calibrates the trace clock against the monotonic clock.
+ */
+static void
+trace_init(void)
+{
+#ifdef TRACE_RDTSC
+	double start;
+	uint64_t ticks;
+
+	start = now_monotonic();
+	ticks = __rdtsc();
+	usleep(10000);
+	trace_ns_per_tick = (now_monotonic() - start) * 1e9 /
+	    (double)(__rdtsc() - ticks);
+#endif
+}
+
+/*
+ * trace_now
+ *
+ * Effects:
+ *   Returns a cheap timestamp in trace clock ticks.  Uses the cycle counter
+ *   where there is one and the coarse monotonic clock otherwise.
+ */
+static uint64_t
+trace_now(void)
+{
+#ifdef TRACE_RDTSC
+	return (__rdtsc());
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+/*
+ * trace_mark
+ *
+ * Effects:
+ *   Records the time of "mark" in the calling thread's trace, if the
+ *   transaction is being traced.  Costs one branch otherwise.
+ */
+static void
+trace_mark(enum trace_mark mark)
+{
+
+	if (trace_current != NULL)
+		trace_current->ts[mark] = trace_now();
+}
+
+/*
+ * trace_end
+ *
+ * Requires:
+ *   The calling thread must be tracing a transaction.
+ *
+ * Effects:
+ *   Copies the calling thread's trace into the ring, overwriting the
+ *   oldest one, and stops tracing.
+ */
+static void
+trace_end(void)
+{
+	struct trace_record *slot;
+	unsigned long ticket;
+
+	ticket = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	slot = &trace_ring[ticket & (TRACE_RING_SIZE - 1)];
+
+	/* Readers discard the slot while "seq" is 0 or has changed. */
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->reqnum = trace_current->reqnum;
+	slot->addr = trace_current->addr;
+	memcpy(slot->ts, trace_current->ts, sizeof(slot->ts));
+	memcpy(slot->uri, trace_current->uri, sizeof(slot->uri));
+	__atomic_store_n(&slot->seq, ticket + 1, __ATOMIC_RELEASE);
+	trace_current = NULL;
+}
+
+/*
+ * trace_log_fields
+ *
+ * Requires:
+ *   The calling thread must be tracing a transaction.
+ *
+ * Effects:
+ *   Writes the spans of the calling thread's trace so far into "fields" as
+ *   " name=microseconds" pairs, using "-" for spans that did not happen.
+ */
+static void
+trace_log_fields(char *fields, size_t len)
+{
+	const uint64_t *ts = trace_current->ts;
+	size_t used = 0;
+	int i;
+
+	fields[0] = '\0';
+	for (i = TRACE_HEADERS; i < TRACE_NMARKS && used < len; i++) {
+		if (ts[i] != 0 && ts[i - 1] != 0)
+			used += snprintf(&fields[used], len - used, " %s_us=%.0f",
+			    trace_span_names[i],
+			    (ts[i] - ts[i - 1]) * trace_ns_per_tick / 1e3);
+		else
+			used += snprintf(&fields[used], len - used, " %s_us=-",
+			    trace_span_names[i]);
+	}
+}
+
+/*
+ * trace_snapshot
+ *
+ * Effects:
+ *   Copies every complete trace in the ring into a newly allocated array,
+ *   oldest first, and returns the number copied.  The caller must free
+ *   "*recordsp".  Traces being overwritten during the copy are skipped.
+ */
+static int
+trace_snapshot(struct trace_record **recordsp)
+{
+	struct trace_record *records, *slot;
+	unsigned long head, ticket, first, seq;
+	int count = 0;
+
+	records = Malloc(sizeof(trace_ring));
+	head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	for (ticket = first; ticket < head; ticket++) {
+		slot = &trace_ring[ticket & (TRACE_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq != ticket + 1)
+			continue;
+		memcpy(&records[count], slot, sizeof(*slot));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			count++;
+	}
+	*recordsp = records;
+	return (count);
+}
+
+/*
+ * trace_dump
+ *
+ * Effects:
+ *   Writes the traces in the ring to the configured trace file, either as
+ *   Chrome trace-event JSON, with one thread per request and one complete
+ *   event per span, or as a binary dump.  The binary dump is, in native
+ *   byte order, TRACE_MAGIC, TRACE_VERSION, TRACE_NMARKS and the record
+ *   count as 32-bit integers, followed by each record's request number and
+ *   client address as 32-bit integers, its marks in nanoseconds as 64-bit
+ *   integers, and its URI as TRACE_URILEN bytes.
+ */
+static void
+trace_dump(void)
+{
+	struct trace_record *records, *rec;
+	struct config *conf;
+	char ip[INET_ADDRSTRLEN];
+	const char *c;
+	uint32_t header[4], ids[2];
+	uint64_t ns[TRACE_NMARKS];
+	FILE *fp;
+	int count, i, j;
+
+	conf = config_acquire();
+	count = trace_snapshot(&records);
+	if ((fp = fopen(conf->trace_path, "w")) == NULL) {
+		fprintf(stderr, "Cannot open trace file %s: %s\n",
+		    conf->trace_path, strerror(errno));
+		config_release(conf);
+		Free(records);
+		return;
+	}
+	if (conf->trace_binary) {
+		header[0] = TRACE_MAGIC;
+		header[1] = TRACE_VERSION;
+		header[2] = TRACE_NMARKS;
+		header[3] = count;
+		fwrite(header, sizeof(header), 1, fp);
+	} else
+		fprintf(fp, "{\"traceEvents\":[");
+	for (i = 0; i < count; i++) {
+		rec = &records[i];
+		for (j = 0; j < TRACE_NMARKS; j++)
+			ns[j] = rec->ts[j] * trace_ns_per_tick;
+		if (conf->trace_binary) {
+			ids[0] = rec->reqnum;
+			ids[1] = rec->addr;
+			fwrite(ids, sizeof(ids), 1, fp);
+			fwrite(ns, sizeof(ns), 1, fp);
+			fwrite(rec->uri, sizeof(rec->uri), 1, fp);
+			continue;
+		}
+
+		/* Name the request's thread after the client and URI. */
+		inet_ntop(AF_INET, &rec->addr, ip, sizeof(ip));
+		fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+		    "\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%d %s ",
+		    i == 0 ? "" : ",", rec->reqnum, rec->reqnum, ip);
+		for (c = rec->uri; *c != '\0'; c++) {
+			if (*c == '"' || *c == '\\')
+				fputc('\\', fp);
+			if (!iscntrl((unsigned char)*c))
+				fputc(*c, fp);
+		}
+		fprintf(fp, "\"}}");
+		for (j = TRACE_HEADERS; j < TRACE_NMARKS; j++) {
+			if (rec->ts[j] == 0 || rec->ts[j - 1] == 0)
+				continue;
+			fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+			    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			    trace_span_names[j], rec->reqnum, ns[j - 1] / 1e3,
+			    (ns[j] - ns[j - 1]) / 1e3);
+		}
+	}
+	if (!conf->trace_binary)
+		fprintf(fp, "\n]}\n");
+	fclose(fp);
+	printf("Dumped %d traces to %s\n", count, conf->trace_path);
+	config_release(conf);
+	Free(records);
+}
+
+/*
+ * pool_init
+ *
+ * Effects:
+ *   Sets up the buffer pool's size classes and one freelist cache per
+ *   configured processor.
+ */
+static void
+pool_init(void)
+{
+	static const size_t sizes[POOL_NCLASSES] = { 256, 2048, POOL_MAX_SIZE };
+	int i;
+
+	/* A task must fit in the smallest class. */
+	assert(sizeof(struct task) <= sizes[0]);
+	for (i = 0; i < POOL_NCLASSES; i++) {
+		Sem_init(&pool_classes[i].mutex, 0, 1);
+		pool_classes[i].partial = NULL;
+		pool_classes[i].size = sizes[i];
+	}
+	if ((pool_ncaches = sysconf(_SC_NPROCESSORS_CONF)) < 1)
+		pool_ncaches = 1;
+	pool_caches = Calloc(pool_ncaches, sizeof(struct pool_cache));
+	for (i = 0; i < pool_ncaches; i++)
+		Sem_init(&pool_caches[i].mutex, 0, 1);
+}
+
+/*
+ * pool_alloc
+ *
+ * Effects:
+ *   Returns a buffer of at least "size" bytes from the smallest size class
+ *   that fits, preferring the calling core's freelist.  Returns NULL if
+ *   "size" exceeds the largest class or if a new slab would exceed the
+ *   configured memory budget.
+ */
+static void *
+pool_alloc(size_t size)
+{
+	struct pool_class *pc;
+	struct pool_cache *cache;
+	struct slab *slab;
+	void *buf;
+	int class, cpu;
+
+	for (class = 0; class < POOL_NCLASSES; class++)
+		if (size <= pool_classes[class].size)
+			break;
+	if (class == POOL_NCLASSES)
+		return (NULL);
+	pc = &pool_classes[class];
+	__atomic_add_fetch(&pool_allocs, 1, __ATOMIC_RELAXED);
+
+	/* Try the calling core's freelist first. */
+	if ((cpu = sched_getcpu()) < 0)
+		cpu = 0;
+	cache = &pool_caches[cpu % pool_ncaches];
+	P(&cache->mutex);
+	if ((buf = cache->free[class]) != NULL) {
+		cache->free[class] = *(void **)buf;
+		cache->count[class]--;
+	}
+	V(&cache->mutex);
+	if (buf != NULL) {
+		__atomic_add_fetch(&pool_cache_hits, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&pool_active, pc->size, __ATOMIC_RELAXED);
+		return (buf);
+	}
+
+	/* Fall back to a slab with free buffers, or a new one. */
+	P(&pc->mutex);
+	if ((slab = pc->partial) == NULL &&
+	    (slab = slab_create(class)) == NULL) {
+		V(&pc->mutex);
+		__atomic_add_fetch(&pool_failures, 1, __ATOMIC_RELAXED);
+		return (NULL);
+	}
+	buf = slab->free;
+	slab->free = *(void **)buf;
+	if (--slab->nfree == 0) {
+		/* Full slabs leave the partial list. */
+		pc->partial = slab->next;
+		if (slab->next != NULL)
+			slab->next->prev = NULL;
+		slab->next = NULL;
+	}
+	V(&pc->mutex);
+	__atomic_add_fetch(&pool_active, pc->size, __ATOMIC_RELAXED);
+	return (buf);
+}
+
+/*
+ * pool_free
+ *
+ * Requires:
+ *   The parameter "buf" must have been returned by pool_alloc() and not yet
+ *   freed.
+ *
+ * Effects:
+ *   Returns "buf" to the calling core's freelist, or to its slab if that
+ *   freelist is full or the slab would then be completely free.  When no
+ *   buffers remain in use, empties every core's freelist, so that idle
+ *   slabs are unmapped and memory use follows the buffers in use.
+ */
+static void
+pool_free(void *buf)
+{
+	struct slab *slab;
+	struct pool_class *pc;
+	struct pool_cache *cache;
+	size_t active;
+	int class, cpu, cached = 0;
+
+	slab = (struct slab *)((uintptr_t)buf & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+	class = slab->class;
+	pc = &pool_classes[class];
+	active = __atomic_sub_fetch(&pool_active, pc->size, __ATOMIC_RELAXED);
+
+	/* A hint only; slab_free() rechecks under the class mutex. */
+	if (__atomic_load_n(&slab->nfree, __ATOMIC_RELAXED) + 1 <
+	    slab->nbufs) {
+		if ((cpu = sched_getcpu()) < 0)
+			cpu = 0;
+		cache = &pool_caches[cpu % pool_ncaches];
+		P(&cache->mutex);
+		if (cache->count[class] < POOL_CACHE_MAX) {
+			*(void **)buf = cache->free[class];
+			cache->free[class] = buf;
+			cache->count[class]++;
+			cached = 1;
+		}
+		V(&cache->mutex);
+	}
+	if (!cached)
+		slab_free(buf);
+	if (active == 0)
+		pool_trim();
+}
+
+/*
+ * pool_trim
+ *
+ * Effects:
+ *   Returns the buffers on every core's freelist to their slabs, unmapping
+ *   the slabs that become completely free.
+ */
+static void
+pool_trim(void)
+{
+	struct pool_cache *cache;
+	void *buf, *next;
+	int class, i;
+
+	for (i = 0; i < pool_ncaches; i++) {
+		cache = &pool_caches[i];
+		for (class = 0; class < POOL_NCLASSES; class++) {
+			P(&cache->mutex);
+			buf = cache->free[class];
+			cache->free[class] = NULL;
+			cache->count[class] = 0;
+			V(&cache->mutex);
+			for (; buf != NULL; buf = next) {
+				next = *(void **)buf;
+				slab_free(buf);
+			}
+		}
+	}
+}
+
+/*
+ * pool_pressure
+ *
+ * Requires:
+ *   The parameter "conf" must point to an acquired configuration.
+ *
+ * Effects:
+ *   Returns 1 if the buffers in use are close enough to the memory budget
+ *   that new connections should be turned away and 0 otherwise.
+ */
+static int
+pool_pressure(const struct config *conf)
+{
+	size_t budget = (size_t)conf->pool_budget_mb << 20;
+
+	return (__atomic_load_n(&pool_active, __ATOMIC_RELAXED) >=
+	    budget / 100 * POOL_PRESSURE);
+}
+
+/*
+ * pool_report
+ *
+ * Effects:
+ *   Prints the buffer pool's statistics.
+ */
+static void
+pool_report(void)
+{
+
+	printf("Pool: %zu bytes active, %zu bytes mapped, %lu allocs, "
+	    "%lu cache hits, %lu failures, %lu slabs mapped, "
+	    "%lu slabs unmapped\n",
+	    __atomic_load_n(&pool_active, __ATOMIC_RELAXED),
+	    __atomic_load_n(&pool_mapped, __ATOMIC_RELAXED),
+	    __atomic_load_n(&pool_allocs, __ATOMIC_RELAXED),
+	    __atomic_load_n(&pool_cache_hits, __ATOMIC_RELAXED),
+	    __atomic_load_n(&pool_failures, __ATOMIC_RELAXED),
+	    __atomic_load_n(&pool_slab_maps, __ATOMIC_RELAXED),
+	    __atomic_load_n(&pool_slab_unmaps, __ATOMIC_RELAXED));
+	fflush(stdout);
+}
+
+/*
+ * slab_create
+ *
+ * Requires:
+ *   The caller must hold the mutex of size class "class", whose partial
+ *   list must be empty.
+ *
+ * Effects:
+ *   Maps a new slab for "class" and makes it the class's partial list.
+ *   Returns NULL if that would exceed the configured memory budget or the
+ *   mapping fails.
+ */
+static struct slab *
+slab_create(int class)
+{
+	struct pool_class *pc = &pool_classes[class];
+	struct config *conf;
+	struct slab *slab;
+	size_t budget, offset;
+	char *map, *aligned, *buf;
+	int i;
+
+	conf = config_acquire();
+	budget = (size_t)conf->pool_budget_mb << 20;
+	config_release(conf);
+	if (__atomic_add_fetch(&pool_mapped, POOL_SLAB_SIZE, __ATOMIC_RELAXED) >
+	    budget) {
+		__atomic_sub_fetch(&pool_mapped, POOL_SLAB_SIZE,
+		    __ATOMIC_RELAXED);
+		return (NULL);
+	}
+
+	/* Over-map, then trim to a POOL_SLAB_SIZE-aligned slab. */
+	map = mmap(NULL, 2 * POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		__atomic_sub_fetch(&pool_mapped, POOL_SLAB_SIZE,
+		    __ATOMIC_RELAXED);
+		return (NULL);
+	}
+	aligned = (char *)(((uintptr_t)map + POOL_SLAB_SIZE - 1) &
+	    ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+	if (aligned > map)
+		munmap(map, aligned - map);
+	munmap(aligned + POOL_SLAB_SIZE, map + POOL_SLAB_SIZE - aligned);
+
+	/* Carve the slab into buffers after the cache-line-aligned header. */
+	slab = (struct slab *)aligned;
+	offset = (sizeof(struct slab) + 63) & ~(size_t)63;
+	slab->prev = slab->next = NULL;
+	slab->class = class;
+	slab->nbufs = slab->nfree = (POOL_SLAB_SIZE - offset) / pc->size;
+	slab->free = NULL;
+	for (i = slab->nbufs - 1; i >= 0; i--) {
+		buf = aligned + offset + i * pc->size;
+		*(void **)buf = slab->free;
+		slab->free = buf;
+	}
+	pc->partial = slab;
+	__atomic_add_fetch(&pool_slab_maps, 1, __ATOMIC_RELAXED);
+	return (slab);
+}
+
+/*
+ * slab_free
+ *
+ * Requires:
+ *   The parameter "buf" must be a buffer of a slab that is neither in use
+ *   nor on any freelist.
+ *
+ * Effects:
+ *   Returns "buf" to its slab, and unmaps the slab if all of its buffers
+ *   are then free.
+ */
+static void
+slab_free(void *buf)
+{
+	struct slab *slab;
+	struct pool_class *pc;
+
+	slab = (struct slab *)((uintptr_t)buf & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+	pc = &pool_classes[slab->class];
+	P(&pc->mutex);
+	*(void **)buf = slab->free;
+	slab->free = buf;
+	if (slab->nfree++ == 0) {
+		/* The slab was full; make it available again. */
+		slab->prev = NULL;
+		slab->next = pc->partial;
+		if (pc->partial != NULL)
+			pc->partial->prev = slab;
+		pc->partial = slab;
+	}
+	if (slab->nfree == slab->nbufs) {
+		if (slab->prev != NULL)
+			slab->prev->next = slab->next;
+		else
+			pc->partial = slab->next;
+		if (slab->next != NULL)
+			slab->next->prev = slab->prev;
+		munmap(slab, POOL_SLAB_SIZE);
+		__atomic_sub_fetch(&pool_mapped, POOL_SLAB_SIZE,
+		    __ATOMIC_RELAXED);
+		__atomic_add_fetch(&pool_slab_unmaps, 1, __ATOMIC_RELAXED);
+	}
+	V(&pc->mutex);
+}
+
+/*
+ * task_buffer
+ *
+ * Requires:
+ *   The parameter "thread_task" must be a valid argument object whose
+ *   buffer "which" has not been taken yet.  The parameter "size" must not
+ *   exceed POOL_MAX_SIZE.
+ *
+ * Effects:
+ *   Takes a buffer of at least "size" bytes from the pool for "which" and
+ *   records it in "thread_task", which returns it when the task ends
+ *   unless task_buffer_release() does so earlier.  If the pool is
+ *   exhausted, sends the client an error and returns NULL.
+ */
+static char *
+task_buffer(struct task *thread_task, enum task_buffer which, size_t size)
+{
+	char *buf;
+
+	if ((buf = pool_alloc(size)) == NULL) {
+		client_error(thread_task->fd, "buffer pool", 503,
+		    "Service Unavailable", "Proxy is out of memory");
+		return (NULL);
+	}
+	thread_task->bufs[which] = buf;
+	return (buf);
+}
+
+/*
+ * task_buffer_release
+ *
+ * Requires:
+ *   The parameter "thread_task" must be a valid argument object.
+ *
+ * Effects:
+ *   Returns buffer "which" of "thread_task" to the pool, if it was taken.
+ */
+static void
+task_buffer_release(struct task *thread_task, enum task_buffer which)
+{
+
+	if (thread_task->bufs[which] != NULL) {
+		pool_free(thread_task->bufs[which]);
+		thread_task->bufs[which] = NULL;
+	}
+}
+
+/*
+ * wait_readable
+ *
+ * Requires:
+ *   The parameter "fd" must be an open file descriptor.
+ *
+ * Effects:
+ *   Waits until "fd" has data to read, for at most "seconds" seconds, or
+ *   indefinitely if "seconds" is 0.  Returns 1 if data is pending, 0 on
+ *   timeout, and -1 on error.
+ */
+static int
+wait_readable(int fd, int seconds)
+{
+	struct pollfd pfd;
+	int rc;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while ((rc = poll(&pfd, 1, seconds > 0 ? seconds * 1000 : -1)) < 0 &&
+	    errno == EINTR)
+		;
+	return (rc);
+}
+
+/*
+ * relay_write
+ *
+ * Requires:
+ *   The parameter "thread_task" must be a valid argument object whose client
+ *   is admitted.
+ *
+ * Effects:
+ *   Writes "n" bytes from "buf" to the task's client, first charging them
+ *   to the client's byte bucket and pacing the write to its byte rate.
+ */
+static void
+relay_write(struct task *thread_task, void *buf, size_t n)
+{
+
+	admit_charge(thread_task->config, thread_task->client, n);
+	Rio_writen_w(thread_task->fd, buf, n);
+}
+
 /*
 	Requires:
 		"newelem" is a legitimate string